@@ -5,6 +5,9 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <assert.h>
+#if defined(__linux__)
+#include <sys/wait.h>
+#endif
 
 uv_thread_t   worker_thread;
 uv_barrier_t  barrier;
@@ -149,6 +152,627 @@ void worker_start(void *arg) {
 
 }
 
+/* Polling Mode **************************************************************/
+
+#define POLL_CALLS 1000
+
+uv_callback_t cb_polled;
+int polled_counter = 0;
+
+void * on_polled(uv_callback_t *callback, void *data, int size) {
+   /* the calls must arrive in order */
+   assert((intptr_t)data == polled_counter);
+   polled_counter++;
+   return NULL;
+}
+
+void poll_producer(void *arg) {
+   intptr_t i;
+   for (i = 0; i < POLL_CALLS; i++) {
+      int rc = uv_callback_fire(&cb_polled, (void*)i, NULL);
+      assert(rc == 0);
+   }
+}
+
+void test_polling_mode() {
+   uv_loop_t loop;
+   uv_thread_t producer;
+   intptr_t i;
+   int rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_polled, on_polled, UV_DEFAULT);
+   assert(rc == 0);
+
+   rc = uv_callback_poll_start(&cb_polled);
+   assert(rc == 0);
+
+   uv_thread_create(&producer, poll_producer, NULL);
+
+   /* spin the loop */
+   while (polled_counter < POLL_CALLS) {
+      uv_run(&loop, UV_RUN_NOWAIT);
+      rc = uv_callback_poll(&cb_polled, 64);
+      assert(rc >= 0 && rc <= 64);
+   }
+
+   uv_thread_join(&producer);
+   printf("polled calls: %d\n", polled_counter);
+
+   /* the calls not processed go back to the queue when the polling stops */
+   for (i = POLL_CALLS; i < POLL_CALLS + 10; i++) {
+      rc = uv_callback_fire(&cb_polled, (void*)i, NULL);
+      assert(rc == 0);
+   }
+   rc = uv_callback_poll(&cb_polled, 3);
+   assert(rc == 3);
+
+   rc = uv_callback_poll_stop(&cb_polled);
+   assert(rc == 0);
+
+   while (polled_counter < POLL_CALLS + 10) {
+      uv_run(&loop, UV_RUN_NOWAIT);
+   }
+
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+/* Dispatch Shaping **********************************************************/
+
+#define HEAVY_CALLS 10
+
+uv_callback_t cb_heavy;
+uv_callback_t cb_light;
+int heavy_counter = 0;
+int light_position = -1;
+
+void * on_heavy(uv_callback_t *callback, void *data, int size) {
+   assert((intptr_t)data == heavy_counter);
+   if (++heavy_counter == HEAVY_CALLS) uv_stop(((uv_handle_t*)&cb_heavy)->loop);
+   return NULL;
+}
+
+void * on_light(uv_callback_t *callback, void *data, int size) {
+   light_position = heavy_counter;
+   return NULL;
+}
+
+void test_dispatch_shaping() {
+   uv_callback_shaping_t shaping = {0};
+   uv_loop_t loop;
+   uint64_t start, elapsed;
+   intptr_t i;
+   int rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_heavy, on_heavy, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_light, on_light, UV_DEFAULT);
+   assert(rc == 0);
+
+   /* 50 calls per second, up to 5 in sequence */
+   shaping.rate = 50;
+   shaping.burst = 5;
+   rc = uv_callback_set_shaping(&cb_heavy, &shaping);
+   printf("uv_callback_set_shaping rc=%d\n", rc);
+   assert(rc == 0);
+
+   start = uv_hrtime();
+   for (i = 0; i < HEAVY_CALLS; i++) {
+      uv_callback_fire(&cb_heavy, (void*)i, NULL);
+   }
+   /* it must not wait for the deferred calls */
+   uv_callback_fire(&cb_light, NULL, NULL);
+
+   uv_run(&loop, UV_RUN_DEFAULT);
+   elapsed = (uv_hrtime() - start) / 1000000;
+
+   printf("shaped calls: %d  elapsed: %d ms  light call after: %d\n", heavy_counter, (int)elapsed, light_position);
+   assert(heavy_counter == HEAVY_CALLS);
+   assert(elapsed >= 80);
+   assert(light_position >= 0 && light_position < HEAVY_CALLS);
+
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+#define COSTLY_CALLS 5
+#define CHEAP_CALLS 20
+
+uv_callback_t cb_costly;
+uv_callback_t cb_cheap;
+int costly_counter = 0;
+int cheap_counter = 0;
+int cheap_before_last_costly = -1;
+
+void * on_costly(uv_callback_t *callback, void *data, int size) {
+   /* use 3 ms of CPU time, over the budget of 1 ms */
+   uint64_t start = uv_hrtime();
+   while (uv_hrtime() - start < 3000000) {}
+   if (++costly_counter == COSTLY_CALLS) {
+      cheap_before_last_costly = cheap_counter;
+      uv_stop(((uv_handle_t*)&cb_costly)->loop);
+   }
+   return NULL;
+}
+
+void * on_cheap(uv_callback_t *callback, void *data, int size) {
+   cheap_counter++;
+   return NULL;
+}
+
+void test_dispatch_max_time() {
+   uv_callback_shaping_t shaping = {0};
+   uv_loop_t loop;
+   uint64_t start, elapsed, cpu;
+   clock_t cpu_start;
+   int i, rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_costly, on_costly, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_cheap, on_cheap, UV_DEFAULT);
+   assert(rc == 0);
+
+   /* 100 us of handler time per millisecond. each call leaves a debt of ~29 ms */
+   shaping.max_time = 100;
+   rc = uv_callback_set_shaping(&cb_costly, &shaping);
+   assert(rc == 0);
+
+   for (i = 0; i < COSTLY_CALLS; i++) {
+      uv_callback_fire(&cb_costly, NULL, NULL);
+   }
+   for (i = 0; i < CHEAP_CALLS; i++) {
+      uv_callback_fire(&cb_cheap, NULL, NULL);
+   }
+
+   start = uv_hrtime();
+   cpu_start = clock();
+   uv_run(&loop, UV_RUN_DEFAULT);
+   elapsed = (uv_hrtime() - start) / 1000000;
+   cpu = (uint64_t)(clock() - cpu_start) * 1000 / CLOCKS_PER_SEC;
+
+   /* the cheap calls must not wait for the costly ones that are paying their debt */
+   printf("costly calls: %d  cheap calls before the last costly call: %d  elapsed: %d ms  cpu: %d ms\n",
+          costly_counter, cheap_before_last_costly, (int)elapsed, (int)cpu);
+   assert(costly_counter == COSTLY_CALLS);
+   assert(cheap_before_last_costly == CHEAP_CALLS);
+   /* the debt is paid sleeping, not spinning */
+   assert(elapsed >= 100);
+   assert(cpu < elapsed / 2);
+
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+/* Batched Results *********************************************************/
+
+#define BATCH_CALLS 100
+
+uv_callback_t cb_double;
+uv_callback_t cb_batch_result;
+int batch_results = 0;
+int batch_invocations = 0;
+intptr_t batch_sum = 0;
+
+void * on_double(uv_callback_t *callback, void *data, int size) {
+   return (void*)((intptr_t)data * 2);
+}
+
+void on_batch_result(uv_callback_t *callback, uv_callback_result_t *results, int count) {
+   int i;
+   assert(count > 0 && count <= UV_CALLBACK_BATCH_MAX);
+   for (i = 0; i < count; i++) {
+      /* the results arrive in order */
+      assert((intptr_t)results[i].data == batch_results * 2);
+      batch_sum += (intptr_t)results[i].data;
+      batch_results++;
+   }
+   batch_invocations++;
+   if (batch_results == BATCH_CALLS) uv_stop(((uv_handle_t*)&cb_double)->loop);
+}
+
+/* used when a single result is delivered */
+void * on_single_result(uv_callback_t *callback, void *data, int size) {
+   uv_callback_result_t result;
+   result.data = data;
+   result.size = size;
+   on_batch_result(callback, &result, 1);
+   return NULL;
+}
+
+void test_batched_results() {
+   uv_callback_shaping_t shaping = {0};
+   uv_loop_t loop;
+   intptr_t i;
+   int rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_double, on_double, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_batch_result, on_single_result, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_set_batch(&cb_batch_result, on_batch_result);
+   assert(rc == 0);
+
+   /* a batch handler cannot be shaped */
+   shaping.rate = 10;
+   rc = uv_callback_set_shaping(&cb_batch_result, &shaping);
+   assert(rc == UV_EINVAL);
+
+   for (i = 0; i < BATCH_CALLS; i++) {
+      rc = uv_callback_fire(&cb_double, (void*)i, &cb_batch_result);
+      assert(rc == 0);
+   }
+
+   uv_run(&loop, UV_RUN_DEFAULT);
+
+   printf("batched results: %d  invocations: %d\n", batch_results, batch_invocations);
+   assert(batch_results == BATCH_CALLS);
+   assert(batch_sum == BATCH_CALLS * (BATCH_CALLS - 1));
+   /* the results are staged while the queue is drained */
+   assert(batch_invocations <= BATCH_CALLS / UV_CALLBACK_BATCH_MAX + 1);
+
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+uv_callback_t cb_stopper;
+uv_callback_t cb_stopped_result;
+int stopped_results = 0;
+int released_results = 0;
+
+void * on_stopper(uv_callback_t *callback, void *data, int size) {
+   /* the result of the previous call is still staged */
+   if (data) uv_callback_stop(&cb_stopped_result);
+   return (void*)1;
+}
+
+void * on_stopped_result(uv_callback_t *callback, void *data, int size) {
+   stopped_results++;
+   return NULL;
+}
+
+void release_result(void *data) {
+   released_results++;
+}
+
+void test_staged_result_to_stopped() {
+   uv_loop_t loop;
+   int i, rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init_ex(&loop, &cb_stopper, on_stopper, UV_DEFAULT, NULL, release_result);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_stopped_result, on_stopped_result, UV_DEFAULT);
+   assert(rc == 0);
+
+   rc = uv_callback_fire(&cb_stopper, NULL, &cb_stopped_result);
+   assert(rc == 0);
+   rc = uv_callback_fire(&cb_stopper, (void*)1, &cb_stopped_result);
+   assert(rc == 0);
+
+   for (i = 0; i < 10; i++) {
+      uv_run(&loop, UV_RUN_NOWAIT);
+   }
+
+   /* the results are released, not delivered to the stopped callback */
+   printf("results to a stopped callback: delivered=%d released=%d\n", stopped_results, released_results);
+   assert(stopped_results == 0);
+   assert(released_results == 2);
+
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+/* Pipelines *****************************************************************/
+
+#define PIPELINE_CALLS 50
+
+uv_callback_t cb_parse;
+uv_callback_t cb_enrich;
+uv_callback_t cb_write;
+uv_callback_t cb_pipeline_result;
+uv_callback_t cb_stop_stage;
+uv_barrier_t stage_barrier;
+int pipeline_results = 0;
+int pipeline_parsed = 0;
+uv_callback_pipeline_t *parse_pipeline;
+
+void * on_parse(uv_callback_t *callback, void *data, int size) {
+   intptr_t *value = malloc(sizeof(intptr_t));
+   assert(value != 0);
+   /* the parsed calls are staged while the queue is drained. they are counted on the next stage */
+   assert(uv_callback_pipeline_depth(parse_pipeline, 1) == pipeline_parsed);
+   pipeline_parsed++;
+   *value = atoi((char*)data);
+   callback->result_size = sizeof(intptr_t);
+   return value;
+}
+
+void * on_enrich(uv_callback_t *callback, void *data, int size) {
+   assert(size == sizeof(intptr_t));
+   *(intptr_t*)data += 1000;
+   return data;
+}
+
+void * on_write(uv_callback_t *callback, void *data, int size) {
+   intptr_t value = *(intptr_t*)data;
+   free(data);
+   return (void*)value;
+}
+
+void * on_pipeline_result(uv_callback_t *callback, void *data, int size) {
+   intptr_t value = (intptr_t)data;
+   assert(value >= 1000 && value < 1000 + PIPELINE_CALLS);
+   if (++pipeline_results == PIPELINE_CALLS) uv_stop(((uv_handle_t*)&cb_parse)->loop);
+   return NULL;
+}
+
+void * stop_stage_cb(uv_callback_t *handle, void *data, int size) {
+   uv_stop(((uv_handle_t*)handle)->loop);
+   return NULL;
+}
+
+void stage_thread(void *arg) {
+   uv_loop_t loop;
+   int rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_enrich, on_enrich, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_stop_stage, stop_stage_cb, UV_COALESCE);
+   assert(rc == 0);
+
+   uv_barrier_wait(&stage_barrier);
+   uv_run(&loop, UV_RUN_DEFAULT);
+
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+void test_pipeline() {
+   uv_callback_pipeline_t pipeline;
+   uv_callback_t *stages[3] = { &cb_parse, &cb_enrich, &cb_write };
+   uv_thread_t thread;
+   uv_loop_t loop;
+   char *text;
+   int i, rc;
+
+   uv_loop_init(&loop);
+   uv_barrier_init(&stage_barrier, 2);
+
+   rc = uv_callback_init_ex(&loop, &cb_parse, on_parse, UV_DEFAULT, NULL, free);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_write, on_write, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_init(&loop, &cb_pipeline_result, on_pipeline_result, UV_DEFAULT);
+   assert(rc == 0);
+
+   /* the second stage runs on another thread */
+   uv_thread_create(&thread, stage_thread, NULL);
+   uv_barrier_wait(&stage_barrier);
+
+   rc = uv_callback_pipeline_init(&pipeline, stages, 3);
+   printf("uv_callback_pipeline_init rc=%d\n", rc);
+   assert(rc == 0);
+   parse_pipeline = &pipeline;
+
+   for (i = 0; i < PIPELINE_CALLS; i++) {
+      text = malloc(16);
+      assert(text != 0);
+      sprintf(text, "%d", i);
+      rc = uv_callback_pipeline_fire(&pipeline, text, strlen(text) + 1, free, &cb_pipeline_result);
+      assert(rc == 0);
+   }
+   assert(uv_callback_pipeline_depth(&pipeline, 0) == PIPELINE_CALLS);
+
+   uv_run(&loop, UV_RUN_DEFAULT);
+
+   printf("pipeline results: %d\n", pipeline_results);
+   assert(pipeline_results == PIPELINE_CALLS);
+   for (i = 0; i < 3; i++) {
+      assert(uv_callback_pipeline_depth(&pipeline, i) == 0);
+   }
+
+   uv_callback_fire(&cb_stop_stage, NULL, NULL);
+   uv_thread_join(&thread);
+
+   uv_callback_pipeline_release(&pipeline);
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+/* Cross-Process Calls *******************************************************/
+
+#if defined(__linux__)
+
+#define SHM_CALLS 100
+
+uv_callback_t cb_shm_sum;
+uv_callback_t cb_shm_result;
+int shm_calls = 0;
+int shm_results = 0;
+
+void * on_shm_sum(uv_callback_t *callback, void *data, int size) {
+   struct numbers *request = (struct numbers *)data;
+   struct numbers *response = malloc(sizeof(struct numbers));
+   assert(size == sizeof(struct numbers));
+   assert(response != 0);
+   response->number1 = request->number1;
+   response->number2 = request->number2;
+   response->result = request->number1 + request->number2;
+   /* the result is copied to the calling process */
+   callback->result_size = sizeof(struct numbers);
+   if (++shm_calls == SHM_CALLS) uv_stop(((uv_handle_t*)callback)->loop);
+   return response;
+}
+
+void * on_shm_result(uv_callback_t *callback, void *data, int size) {
+   struct numbers *response = (struct numbers *)data;
+   assert(size == sizeof(struct numbers));
+   assert(response->result == response->number1 + response->number2);
+   free(response);
+   if (++shm_results == SHM_CALLS) uv_stop(((uv_handle_t*)callback)->loop);
+   return NULL;
+}
+
+void on_shm_timeout(uv_timer_t *timer) {
+   uv_stop(timer->loop);
+}
+
+void shm_client(int fds[3]) {
+   uv_loop_t loop;
+   uv_callback_shm_t shm, shm2;
+   struct numbers req;
+   int i, rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_shm_result, on_shm_result, UV_DEFAULT);
+   assert(rc == 0);
+
+   rc = uv_callback_import(&loop, &shm, fds);
+   assert(rc == 0);
+
+   /* the results ring can have a single consumer */
+   rc = uv_callback_import(&loop, &shm2, fds);
+   assert(rc == UV_EBUSY);
+
+   /* the arguments are copied to the shared memory */
+   for (i = 0; i < SHM_CALLS; i++) {
+      req.number1 = i;
+      req.number2 = i * 2;
+      req.result = 0;
+      rc = uv_callback_shm_fire(&shm, &req, sizeof(req), &cb_shm_result);
+      assert(rc == 0);
+   }
+
+   uv_run(&loop, UV_RUN_DEFAULT);
+
+   uv_callback_shm_close(&shm);
+   _exit(shm_results == SHM_CALLS ? 0 : 1);
+}
+
+void test_cross_process_calls() {
+   uv_loop_t loop;
+   uv_timer_t timer;
+   uv_callback_shm_t shm;
+   int fds[3], rc, status;
+   pid_t pid;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init_ex(&loop, &cb_shm_sum, on_shm_sum, UV_DEFAULT, NULL, free);
+   assert(rc == 0);
+
+   rc = uv_callback_export(&cb_shm_sum, &shm, 128, sizeof(struct numbers));
+   printf("uv_callback_export rc=%d\n", rc);
+   assert(rc == 0);
+   uv_callback_shm_fds(&shm, fds);
+
+   pid = fork();
+   assert(pid >= 0);
+   if (pid == 0) shm_client(fds);
+
+   uv_timer_init(&loop, &timer);
+   uv_timer_start(&timer, on_shm_timeout, 5000, 0);
+
+   uv_run(&loop, UV_RUN_DEFAULT);
+
+   uv_callback_shm_close(&shm);
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+
+   waitpid(pid, &status, 0);
+   printf("cross-process calls: %d  client status: %d\n", shm_calls, status);
+   assert(shm_calls == SHM_CALLS);
+   assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void test_shm_corrupted_ring() {
+   uv_loop_t loop;
+   uv_callback_shm_t shm;
+   struct shm_ring *ring;
+   struct shm_slot *slot;
+   uint64_t tail;
+   int rc;
+
+   uv_loop_init(&loop);
+
+   rc = uv_callback_init(&loop, &cb_shm_sum, on_shm_sum, UV_DEFAULT);
+   assert(rc == 0);
+   rc = uv_callback_export(&cb_shm_sum, &shm, 8, sizeof(struct numbers));
+   assert(rc == 0);
+
+   /* the peer moves the sequence of the next slot ahead of the tail */
+   ring = &shm.mem->ring[SHM_RING_RESULTS];
+   tail = ring->tail;
+   slot = shm_get_slot(&shm, SHM_RING_RESULTS, tail);
+   slot->seq = tail + 1;
+   rc = shm_ring_push(&shm, SHM_RING_RESULTS, 0, NULL, 0, 0);
+   printf("push on a corrupted ring rc=%d\n", rc);
+   assert(rc == UV_EPROTO);
+
+   slot->seq = tail + 1000;
+   rc = shm_ring_push(&shm, SHM_RING_RESULTS, 0, NULL, 0, 0);
+   assert(rc == UV_EPROTO);
+
+   uv_callback_shm_close(&shm);
+   uv_callback_stop_all(&loop);
+   uv_walk(&loop, on_walk, NULL);
+   uv_run(&loop, UV_RUN_DEFAULT);
+   uv_loop_close(&loop);
+}
+
+#endif
+
+/* Tracing *******************************************************************/
+
+void test_trace_dump() {
+   FILE *file = tmpfile();
+   char buf[16384];
+   size_t len;
+   int rc;
+
+   assert(file != 0);
+   rc = uv_callback_trace_dump(file);
+   printf("uv_callback_trace_dump rc=%d\n", rc);
+   /* enqueue, dequeue, start and end of the call and of its result */
+   assert(rc >= 8);
+
+   rewind(file);
+   len = fread(buf, 1, sizeof(buf) - 1, file);
+   buf[len] = 0;
+   fclose(file);
+   assert(strncmp(buf, "{\"traceEvents\":[", 16) == 0);
+   assert(strstr(buf, "\"name\":\"notify\",\"cat\":\"uv_callback\",\"ph\":\"B\"") != NULL);
+   assert(strstr(buf, "\"ph\":\"f\"") != NULL);
+}
+
 /* Main Thread ***************************************************************/
 
 uv_callback_t cb_result;
@@ -228,6 +852,9 @@ int main() {
    req->number2 = 456;
    req->result = 0;
 
+   /* trace this call and its result */
+   uv_callback_trace_enable(1);
+
    /* call the function in the other thread */
    uv_callback_fire(&cb_sum, req, &cb_result);
 
@@ -241,6 +868,9 @@ int main() {
    uv_run(loop, UV_RUN_DEFAULT);
    uv_loop_close(loop);
 
+   uv_callback_trace_enable(0);
+   test_trace_dump();
+
    /* check the values */
    assert(progress_called > 0);
    assert(static_call_counter == 3);
@@ -313,6 +943,27 @@ int main() {
    uv_callback_fire(&cb_static_pointer, msg1, NULL);
 
 
+   /* test the polling mode */
+   test_polling_mode();
+
+   /* test the dispatch shaping */
+   test_dispatch_shaping();
+   test_dispatch_max_time();
+
+   /* test the delivery of results in batches */
+   test_batched_results();
+   test_staged_result_to_stopped();
+
+   /* test a pipeline with stages on different threads */
+   test_pipeline();
+
+#if defined(__linux__)
+   /* test calls from another process */
+   test_cross_process_calls();
+   test_shm_corrupted_ring();
+#endif
+
+
    puts("All tests pass!");
    return 0;
 }
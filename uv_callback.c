@@ -1,5 +1,16 @@
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
 #include "uv_callback.h"
+#if defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
 
 // not covered now: closing a uv_callback handle does not release all the resources
 // automatically.
@@ -7,6 +18,220 @@
 // for now we must use the uv_callback_stop or .._stop_all before closing the event
 // loop and then call uv_callback_release on the callback from uv_close.
 
+/*****************************************************************************/
+/* TRACING *******************************************************************/
+/*****************************************************************************/
+
+// when enabled, each call receives a trace id and its events (enqueue,
+// dequeue, handler start and end, notify delivery) are stored on a ring
+// buffer owned by the thread generating them, so no lock is needed.
+// when disabled, the cost is a single test of a global flag.
+// if compiled with UV_CALLBACK_USDT the events are also exposed as USDT
+// probes (provider uv_callback) to be used with perf or bpftrace. the probes
+// have semaphores, so the trace ids are generated while a probe is attached
+// even if the tracing is disabled.
+
+#ifndef UV_CALLBACK_TRACE_SIZE
+#define UV_CALLBACK_TRACE_SIZE  4096   /* events kept per thread */
+#endif
+
+#if defined(UV_CALLBACK_USDT)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define UV_CALLBACK_SEMAPHORE(name)  unsigned short uv_callback_##name##_semaphore __attribute__((section(".probes")))
+UV_CALLBACK_SEMAPHORE(enqueue);
+UV_CALLBACK_SEMAPHORE(dequeue);
+UV_CALLBACK_SEMAPHORE(start);
+UV_CALLBACK_SEMAPHORE(end);
+#define UV_CALLBACK_PROBE(name, call)  STAP_PROBE2(uv_callback, name, (call)->trace_id, (call)->callback)
+#define UV_CALLBACK_PROBES_ENABLED()   (uv_callback_enqueue_semaphore | uv_callback_dequeue_semaphore | \
+                                        uv_callback_start_semaphore | uv_callback_end_semaphore)
+#else
+#define UV_CALLBACK_PROBE(name, call)
+#define UV_CALLBACK_PROBES_ENABLED()   0
+#endif
+
+/* the trace id is assigned before the probe fires */
+#define TRACE_CALL(name, type, call)  do { \
+   if (trace_enabled() || UV_CALLBACK_PROBES_ENABLED()) trace_event(call, type); \
+   UV_CALLBACK_PROBE(name, call); \
+} while (0)
+
+#if defined(__GNUC__)
+#define trace_load(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define trace_store(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define trace_enabled()    __atomic_load_n(&uv_callback_tracing, __ATOMIC_RELAXED)
+#define trace_set(v)       __atomic_store_n(&uv_callback_tracing, v, __ATOMIC_RELAXED)
+#else
+#define trace_load(p)      (*(volatile uint64_t*)(p))
+#define trace_store(p, v)  (*(volatile uint64_t*)(p) = (v))
+#define trace_enabled()    (*(volatile int*)&uv_callback_tracing)
+#define trace_set(v)       (*(volatile int*)&uv_callback_tracing = (v))
+#endif
+
+enum {
+   TRACE_ENQUEUE,
+   TRACE_DEQUEUE,
+   TRACE_START,
+   TRACE_END
+};
+
+struct trace_event {
+   uint64_t time;             /* uv_hrtime() */
+   uint64_t trace_id;
+   uv_callback_t *callback;
+   int type;
+   int is_result;
+};
+
+struct trace_ring {
+   struct trace_ring *next;   /* list of all the rings */
+   int tid;                   /* sequential thread id */
+   uint64_t last_id;          /* last trace id generated on this thread */
+   uint64_t count;            /* number of events written. only the last ones are kept */
+   struct trace_event events[UV_CALLBACK_TRACE_SIZE];
+};
+
+int uv_callback_tracing = 0;   /* read by all the threads, using trace_enabled() */
+
+static uv_once_t trace_once = UV_ONCE_INIT;
+static uv_key_t trace_key;
+static uv_mutex_t trace_mutex;       /* protects the list of rings */
+static struct trace_ring *trace_rings = NULL;
+static int trace_threads = 0;
+
+static void trace_init(void) {
+   uv_key_create(&trace_key);
+   uv_mutex_init(&trace_mutex);
+}
+
+// the rings are not released when the threads exit, so their events
+// can still be dumped.
+
+static struct trace_ring * trace_get_ring(void) {
+   struct trace_ring *ring;
+
+   uv_once(&trace_once, trace_init);
+
+   ring = uv_key_get(&trace_key);
+   if (!ring) {
+      ring = calloc(1, sizeof(struct trace_ring));
+      if (!ring) return NULL;
+      uv_mutex_lock(&trace_mutex);
+      ring->tid = ++trace_threads;
+      ring->next = trace_rings;
+      trace_rings = ring;
+      uv_mutex_unlock(&trace_mutex);
+      uv_key_set(&trace_key, ring);
+   }
+
+   return ring;
+}
+
+static void trace_event(uv_call_t *call, int type) {
+   struct trace_ring *ring = trace_get_ring();
+   struct trace_event *event;
+
+   if (!ring) return;
+
+   /* calls fired while tracing was disabled are not traced */
+   if (call->trace_id == 0) {
+      if (type != TRACE_ENQUEUE) return;
+      call->trace_id = ((uint64_t)ring->tid << 40) | ++ring->last_id;
+   }
+
+   /* only the probes are active */
+   if (!trace_enabled()) return;
+
+   event = &ring->events[ring->count % UV_CALLBACK_TRACE_SIZE];
+   event->time = uv_hrtime();
+   event->trace_id = call->trace_id;
+   event->callback = call->callback;
+   event->type = type;
+   event->is_result = call->is_result;
+   trace_store(&ring->count, ring->count + 1);
+}
+
+void uv_callback_trace_enable(int enable) {
+   uv_once(&trace_once, trace_init);
+   trace_set(enable);
+}
+
+static void trace_write_event(FILE *file, int pid, int tid, struct trace_event *event, int first) {
+   static const char *names[] = { "enqueue", "dequeue", "call", "call" };
+   const char *name = (event->is_result && event->type >= TRACE_START) ? "notify" : names[event->type];
+   double ts = event->time / 1000.0;
+
+   if (!first) fputs(",\n", file);
+
+   switch (event->type) {
+   case TRACE_ENQUEUE:
+   case TRACE_DEQUEUE:
+      fprintf(file, "{\"name\":\"%s\",\"cat\":\"uv_callback\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"trace_id\":\"0x%" PRIx64 "\",\"callback\":\"%p\"}},\n",
+                    name, ts, pid, tid, event->trace_id, (void*)event->callback);
+      /* the enqueue of the first call starts a flow. the other events continue it */
+      fprintf(file, "{\"name\":\"call\",\"cat\":\"uv_callback\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":\"0x%" PRIx64 "\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    (event->type == TRACE_ENQUEUE && !event->is_result) ? "s" : "t", event->trace_id, ts, pid, tid);
+      break;
+   case TRACE_START:
+      fprintf(file, "{\"name\":\"%s\",\"cat\":\"uv_callback\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"trace_id\":\"0x%" PRIx64 "\",\"callback\":\"%p\"}}",
+                    name, ts, pid, tid, event->trace_id, (void*)event->callback);
+      if (event->is_result) {
+         /* the notify delivery ends the flow */
+         fprintf(file, ",\n{\"name\":\"call\",\"cat\":\"uv_callback\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"0x%" PRIx64 "\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                       event->trace_id, ts, pid, tid);
+      }
+      break;
+   case TRACE_END:
+      fprintf(file, "{\"name\":\"%s\",\"cat\":\"uv_callback\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    name, ts, pid, tid);
+      break;
+   }
+}
+
+// writes the events in the Chrome trace event format (chrome://tracing, Perfetto).
+// it can run while other threads are generating events: the events that were
+// overwritten while being copied are discarded.
+
+int uv_callback_trace_dump(FILE *file) {
+   static struct trace_event events[UV_CALLBACK_TRACE_SIZE];
+   struct trace_ring *ring;
+   int pid = (int) uv_os_getpid();
+   int total = 0;
+
+   if (!file) return UV_EINVAL;
+
+   uv_once(&trace_once, trace_init);
+
+   fputs("{\"traceEvents\":[\n", file);
+
+   uv_mutex_lock(&trace_mutex);
+   for (ring = trace_rings; ring; ring = ring->next) {
+      uint64_t first, last, i;
+      last = trace_load(&ring->count);
+      first = last > UV_CALLBACK_TRACE_SIZE ? last - UV_CALLBACK_TRACE_SIZE : 0;
+      for (i = first; i < last; i++) {
+         events[i % UV_CALLBACK_TRACE_SIZE] = ring->events[i % UV_CALLBACK_TRACE_SIZE];
+      }
+      /* discard the events overwritten while copying. the slot of the
+      event i - SIZE can be in the middle of a write */
+      i = trace_load(&ring->count);
+      if (i >= UV_CALLBACK_TRACE_SIZE && i - UV_CALLBACK_TRACE_SIZE + 1 > first) {
+         first = i - UV_CALLBACK_TRACE_SIZE + 1;
+      }
+      for (i = first; i < last; i++) {
+         trace_write_event(file, pid, ring->tid, &events[i % UV_CALLBACK_TRACE_SIZE], total++ == 0);
+      }
+   }
+   uv_mutex_unlock(&trace_mutex);
+
+   fputs("\n]}\n", file);
+
+   return total;
+}
+
 /*****************************************************************************/
 /* RECEIVER / CALLED THREAD **************************************************/
 /*****************************************************************************/
@@ -15,6 +240,7 @@
 #define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 #endif
 
+void uv_callback_async_cb(uv_async_t* handle);
 void uv_callback_idle_cb(uv_idle_t* handle);
 
 /* Master Callback ***********************************************************/
@@ -54,6 +280,9 @@ void uv_callback_release(uv_callback_t *callback) {
          if (callback->idle_active) {
             uv_idle_stop(&callback->idle);
          }
+         if (callback->timer_init) {
+            uv_timer_stop(&callback->timer);
+         }
          /* release the object */
          callback->free_cb(callback);
       }
@@ -62,6 +291,29 @@ void uv_callback_release(uv_callback_t *callback) {
 
 /* Dequeue *******************************************************************/
 
+void discard_call(uv_call_t *call) {
+   if (call->data) {
+      if (call->free_data) {
+         call->free_data(call->data);
+      } else if (call->pipeline && call->stage > 0) {
+         /* the data is the result of the previous stage */
+         uv_callback_t *previous = call->pipeline->stages[call->stage - 1];
+         if (previous->free_result) previous->free_result(call->data);
+      } else if (call->is_result && call->free_result) {
+         call->free_result(call->data);
+      }
+   }
+   free(call);
+}
+
+/* the depth of a pipeline stage is protected by the mutex of its master */
+void pipeline_count(uv_call_t *call, int delta) {
+   uv_callback_t *master = call->callback->master ? call->callback->master : call->callback;
+   uv_mutex_lock(&master->mutex);
+   call->pipeline->depth[call->stage] += delta;
+   uv_mutex_unlock(&master->mutex);
+}
+
 void * dequeue_call(uv_callback_t* callback) {
    uv_call_t *current, *prev = NULL;
 
@@ -78,13 +330,47 @@ void * dequeue_call(uv_callback_t* callback) {
    else
       callback->queue = NULL;
 
+   if (current && current->pipeline) current->pipeline->depth[current->stage]--;
+
    uv_mutex_unlock(&callback->mutex);
 
    return current;
 }
 
+/* removes up to max calls to the given callback from the queue, the oldest first */
+int dequeue_batch(uv_callback_t* master, uv_callback_t* callback, uv_call_t **calls, int max) {
+   uv_call_t *call, **link;
+   int count = 0, skip, pos;
+
+   uv_mutex_lock(&master->mutex);
+
+   for (call = master->queue; call; call = call->next) {
+      if (call->callback == callback) count++;
+   }
+
+   /* the newest calls stay on the queue */
+   skip = count > max ? count - max : 0;
+   count -= skip;
+   pos = count;
+
+   link = &master->queue;
+   while ((call = *link)) {
+      if (call->callback == callback && skip-- <= 0) {
+         *link = call->next;
+         if (call->pipeline) call->pipeline->depth[call->stage]--;
+         calls[--pos] = call;
+      } else {
+         link = &call->next;
+      }
+   }
+
+   uv_mutex_unlock(&master->mutex);
+
+   return count;
+}
+
 void dequeue_all_from_callback(uv_callback_t* master, uv_callback_t* callback) {
-   uv_call_t *call, *prev = NULL;
+   uv_call_t *call, *prev = NULL, **link;
 
    if (!master) master = callback;
 
@@ -99,11 +385,9 @@ void dequeue_all_from_callback(uv_callback_t* master, uv_callback_t* callback) {
             prev->next = next;
          else
             master->queue = next;
+         if (call->pipeline) call->pipeline->depth[call->stage]--;
          /* discard this call */
-         if (call->data && call->free_data) {
-            call->free_data(call->data);
-         }
-         free(call);
+         discard_call(call);
       } else {
          prev = call;
       }
@@ -111,42 +395,419 @@ void dequeue_all_from_callback(uv_callback_t* master, uv_callback_t* callback) {
       call = next;
    }
 
+   /* the calls taken by uv_callback_poll are still counted as queued */
+   for (link = &master->polled; (call = *link); ) {
+      if (call->callback == callback) {
+         *link = call->next;
+         if (call->pipeline) call->pipeline->depth[call->stage]--;
+         discard_call(call);
+      } else {
+         link = &call->next;
+      }
+   }
+
    callback->queue = NULL;
 
    uv_mutex_unlock(&master->mutex);
 
 }
 
+/* Dispatch Shaping **********************************************************/
+
+// a shaped callback has its calls deferred (not dropped) when it has no
+// tokens available on its rate limiter or when its handler used more time
+// than its budget per loop iteration. the deferred calls stay on a local
+// list of the callback, so the calls to other callbacks on the same master
+// queue are not delayed by them.
+// the handler time is the CPU time of the loop thread, so it is not charged
+// for the time the thread was preempted. the excess over max_time is paid at
+// max_time per millisecond of loop time (uv_now), and the loop sleeps on a
+// timer while the debt is pending.
+// a callback with a batch handler cannot be shaped.
+
+void uv_callback_timer_cb(uv_timer_t* handle);
+
+static uint64_t shaping_cpu_time(void) {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+   struct timespec ts;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+   }
+#endif
+   return uv_hrtime();
+}
+
+static int shaping_ready(uv_callback_t* callback, uint64_t now) {
+   uv_callback_shaping_t *shaping = &callback->shaping;
+
+   if (!callback->shaped) return 1;
+
+   /* the excess of handler time is paid on the next iterations */
+   if (callback->time_debt > 0) return 0;
+
+   if (shaping->rate > 0) {
+      double burst = shaping->burst > 1 ? shaping->burst : 1;
+      callback->tokens += (now - callback->last_refill) * shaping->rate / 1e9;
+      if (callback->tokens > burst) callback->tokens = burst;
+      callback->last_refill = now;
+      if (callback->tokens < 1) return 0;
+   }
+
+   return 1;
+}
+
+static void shaping_account(uv_callback_t* callback, uint64_t start) {
+   uv_callback_shaping_t *shaping = &callback->shaping;
+
+   if (shaping->rate > 0) {
+      callback->tokens -= 1;
+   }
+   if (shaping->max_time > 0) {
+      uint64_t elapsed = (shaping_cpu_time() - start) / 1000;
+      if (elapsed > shaping->max_time) {
+         callback->time_debt += elapsed - shaping->max_time;
+      }
+   }
+}
+
+static void shaping_defer(uv_callback_t* callback, uv_call_t *call) {
+   /* a deferred call is still waiting on its pipeline stage */
+   if (call->pipeline) pipeline_count(call, 1);
+   call->next = NULL;
+   if (callback->deferred_tail)
+      callback->deferred_tail->next = call;
+   else
+      callback->deferred = call;
+   callback->deferred_tail = call;
+}
+
+/* returns the next call that can be dispatched now */
+uv_call_t * dequeue_shaped_call(uv_callback_t* master) {
+   uint64_t now = uv_hrtime();
+   uint64_t loop_time = uv_now(((uv_handle_t*)master)->loop);
+   uv_callback_t *callback;
+   uv_call_t *call;
+
+   /* pay one budget of the debt for each millisecond elapsed */
+   if (loop_time != master->paid_at) {
+      uint64_t elapsed = loop_time - master->paid_at;
+      master->paid_at = loop_time;
+      for (callback = master; callback; callback = callback->next) {
+         uint64_t paid = callback->shaping.max_time * elapsed;
+         callback->time_debt = callback->time_debt > paid ? callback->time_debt - paid : 0;
+      }
+   }
+
+   /* the deferred calls go first to keep the order of the calls to each callback */
+   for (callback = master; callback; callback = callback->next) {
+      if (callback->deferred && shaping_ready(callback, now)) {
+         call = callback->deferred;
+         callback->deferred = call->next;
+         if (!callback->deferred) callback->deferred_tail = NULL;
+         if (call->pipeline) pipeline_count(call, -1);
+         return call;
+      }
+   }
+
+   while ((call = dequeue_call(master))) {
+      callback = call->callback;
+      if (!callback->deferred && shaping_ready(callback, now)) {
+         return call;
+      }
+      shaping_defer(callback, call);
+   }
+
+   return NULL;
+}
+
+/* when only deferred calls remain, wait until one of them can be dispatched */
+static void shaping_wait(uv_callback_t* master) {
+   uv_callback_t *callback;
+   double wait = -1;
+
+   for (callback = master; callback; callback = callback->next) {
+      double time = 0;
+      if (!callback->deferred) continue;
+      if (callback->time_debt > 0 && callback->shaping.max_time > 0) {
+         /* time to pay the debt */
+         uint64_t max_time = callback->shaping.max_time;
+         time = (double)((callback->time_debt + max_time - 1) / max_time);
+      }
+      if (callback->shaping.rate > 0 && callback->tokens < 1) {
+         double refill = (1 - callback->tokens) / callback->shaping.rate * 1000;
+         if (refill > time) time = refill;
+      }
+      if (wait < 0 || time < wait) wait = time;
+   }
+
+   uv_idle_stop(&master->idle);
+   master->idle_active = 0;
+
+   if (wait >= 0) {
+      uv_timer_start(&master->timer, uv_callback_timer_cb, (uint64_t)wait + 1, 0);
+   }
+}
+
+void uv_callback_timer_cb(uv_timer_t* handle) {
+   uv_callback_t* callback = container_of(handle, uv_callback_t, timer);
+   uv_callback_async_cb((uv_async_t*)callback);
+}
+
+int uv_callback_set_batch(uv_callback_t* callback, uv_callback_batch_func function) {
+   if (!callback || !callback->usequeue) return UV_EINVAL;
+   if (function && callback->shaped) return UV_EINVAL;
+   callback->batch_function = function;
+   return 0;
+}
+
+int uv_callback_set_shaping(uv_callback_t* callback, const uv_callback_shaping_t* shaping) {
+   uv_callback_t *master;
+   int rc;
+
+   if (!callback || !shaping || !callback->usequeue) return UV_EINVAL;
+   if (shaping->rate < 0 || shaping->burst < 0) return UV_EINVAL;
+   /* the batches would bypass the limits and the order of the deferred calls */
+   if (callback->batch_function && (shaping->rate > 0 || shaping->max_time > 0)) return UV_EINVAL;
+
+   master = callback->master ? callback->master : callback;
+   if (!master->timer_init) {
+      rc = uv_timer_init(((uv_handle_t*)master)->loop, &master->timer);
+      if (rc) return rc;
+      master->timer_init = 1;
+   }
+
+   callback->shaping = *shaping;
+   callback->shaped = (shaping->rate > 0 || shaping->max_time > 0);
+   callback->tokens = shaping->burst > 1 ? shaping->burst : 1;
+   callback->last_refill = uv_hrtime();
+   callback->time_debt = 0;
+
+   if (callback->shaped) master->has_shaped = 1;
+   return 0;
+}
+
+/* Result Delivery ***********************************************************/
+
+// the results are not fired one by one to the notify callbacks. the call
+// record is reused to carry the result (or to move it to the next stage of
+// a pipeline) and it is staged on the dispatching master. the staged calls
+// are kept across the loop iterations and flushed when the queue is drained
+// or when UV_CALLBACK_BATCH_MAX of them are staged. then the calls headed to
+// the same loop are spliced into its queue at once, with a single lock and
+// wake up.
+// a staged result holds a reference to its notify callback until it is
+// spliced, and the results to callbacks stopped meanwhile are discarded.
+
+/* releases a staged call that will not be delivered */
+void discard_result(uv_call_t *call) {
+   uv_callback_t *notify = call->is_result ? call->callback : call->notify;
+   discard_call(call);
+   if (notify) uv_callback_release(notify);
+}
+
+void stage_result(uv_callback_t* master, uv_call_t *call) {
+   call->next = master->results;
+   master->results = call;
+   master->staged++;
+}
+
+void flush_results(uv_callback_t* master) {
+
+   master->staged = 0;
+
+   while (master->results) {
+      uv_call_t *call = master->results, *first = NULL, *last = NULL, *discarded = NULL, **link;
+      uv_callback_t *target = call->callback->master ? call->callback->master : call->callback;
+
+      /* move the results to this loop to a separate list, keeping the order */
+      link = &master->results;
+      while ((call = *link)) {
+         uv_callback_t *dest = call->callback->master ? call->callback->master : call->callback;
+         if (dest == target) {
+            *link = call->next;
+            call->next = NULL;
+            if (last) last->next = call; else first = call;
+            last = call;
+         } else {
+            link = &call->next;
+         }
+      }
+
+      /* add them to the queue. the newest first */
+      uv_mutex_lock(&target->mutex);
+      last = NULL;
+      for (link = &first; (call = *link); ) {
+         if (call->callback->inactive) {
+            /* the callback was stopped after the call was staged */
+            if (call->pipeline) call->pipeline->depth[call->stage]--;
+            *link = call->next;
+            call->next = discarded;
+            discarded = call;
+            continue;
+         }
+         if (call->is_result) uv_callback_release(call->callback);
+         last = call;
+         link = &call->next;
+      }
+      if (first) {
+         last->next = target->queue;
+         target->queue = first;
+         /* signaled before unlocking, so a stopped loop is not signaled */
+         if (!target->polling) uv_async_send((uv_async_t*)target);
+      }
+      uv_mutex_unlock(&target->mutex);
+
+      /* the target may be released here */
+      while ((call = discarded)) {
+         discarded = call->next;
+         discard_result(call);
+      }
+   }
+
+}
+
 /* Callback Function Call ****************************************************/
 
+void call_done(uv_call_t *call, void *result) {
+   uv_callback_t *callback = call->callback;
+   uv_callback_t *notify = call->notify;
+
+   if (call->data && call->free_data) {
+      call->free_data(call->data);
+   }
+
+   /* move this call record to the next stage of the pipeline */
+   if (call->pipeline && call->stage + 1 < call->pipeline->count) {
+      uv_callback_t *next = call->pipeline->stages[call->stage + 1];
+      if (!next->inactive) {
+         call->callback = next;
+         call->data = result;
+         call->size = callback->result_size;
+         call->free_data = NULL;
+         call->stage++;
+         /* counted on the next stage while it is staged */
+         pipeline_count(call, 1);
+         TRACE_CALL(enqueue, TRACE_ENQUEUE, call);
+         stage_result(callback->master ? callback->master : callback, call);
+         return;
+      }
+      /* the pipeline was interrupted */
+      if (result && callback->free_result) {
+         callback->free_result(result);
+      }
+      if (notify) {
+         uv_callback_release(notify);
+      }
+      free(call);
+      return;
+   }
+
+   /* check if the result notification callback is still active */
+   if (notify && !notify->inactive) {
+      /* reuse this call record to deliver the result */
+      call->callback = notify;
+      call->data = result;
+      call->size = callback->result_size;
+      call->free_data = NULL;
+      call->notify = NULL;
+      call->pipeline = NULL;
+      call->is_result = 1;
+      call->free_result = callback->free_result;
+      TRACE_CALL(enqueue, TRACE_ENQUEUE, call);
+      /* the reference to notify is released when the result is spliced */
+      stage_result(callback->master ? callback->master : callback, call);
+      return;
+   } else if (result && callback->free_result) {
+      callback->free_result(result);
+   }
+
+   if (notify) {
+      uv_callback_release(notify);
+   }
+   free(call);
+}
+
+void uv_callback_call(uv_call_t *call) {
+   void *result;
+   TRACE_CALL(start, TRACE_START, call);
+   call->callback->result_size = 0;
+   result = call->callback->function(call->callback, call->data, call->size);
+   TRACE_CALL(end, TRACE_END, call);
+   call_done(call, result);
+}
+
+/* calls to the same batch callback, the oldest first */
+void batch_call(uv_call_t **calls, int count) {
+   uv_callback_t *callback = calls[0]->callback;
+   uv_callback_result_t results[UV_CALLBACK_BATCH_MAX];
+   int i;
+
+   for (i = 0; i < count; i++) {
+      TRACE_CALL(start, TRACE_START, calls[i]);
+      results[i].data = calls[i]->data;
+      results[i].size = calls[i]->size;
+   }
+
+   callback->result_size = 0;
+   callback->batch_function(callback, results, count);
+
+   for (i = 0; i < count; i++) {
+      TRACE_CALL(end, TRACE_END, calls[i]);
+      call_done(calls[i], NULL);
+   }
+}
+
 void uv_callback_async_cb(uv_async_t* handle) {
    uv_callback_t* callback = (uv_callback_t*) handle;
 
    if (callback->usequeue) {
-      uv_call_t *call = dequeue_call(callback);
-      if (call) {
-         void *result = call->callback->function(call->callback, call->data, call->size);
-         /* check if the result notification callback is still active */
-         if (call->notify && !call->notify->inactive) {
-            uv_callback_fire(call->notify, result, NULL);
-         } else if (result && call->callback->free_result) {
-            call->callback->free_result(result);
+      uv_call_t *call;
+      /* on polling mode the queue is drained by uv_callback_poll */
+      if (callback->polling) {
+         flush_results(callback);
+         if (callback->idle_active) {
+            uv_idle_stop(&callback->idle);
+            callback->idle_active = 0;
          }
-         if (call->notify) {
-            uv_callback_release(call->notify);
+         return;
+      }
+      call = callback->has_shaped ? dequeue_shaped_call(callback) : dequeue_call(callback);
+      if (call) {
+         TRACE_CALL(dequeue, TRACE_DEQUEUE, call);
+         if (call->callback->batch_function) {
+            /* deliver the other queued calls to this callback together */
+            uv_call_t *calls[UV_CALLBACK_BATCH_MAX];
+            int i, count;
+            calls[0] = call;
+            count = 1 + dequeue_batch(callback, call->callback, calls + 1, UV_CALLBACK_BATCH_MAX - 1);
+            for (i = 1; i < count; i++) {
+               TRACE_CALL(dequeue, TRACE_DEQUEUE, calls[i]);
+            }
+            batch_call(calls, count);
+         } else if (call->callback->shaped) {
+            uv_callback_t *called = call->callback;
+            uint64_t start = shaping_cpu_time();
+            uv_callback_call(call);
+            shaping_account(called, start);
+         } else {
+            uv_callback_call(call);
          }
-         if (call->data && call->free_data) {
-            call->free_data(call->data);
+         if (callback->staged >= UV_CALLBACK_BATCH_MAX) {
+            flush_results(callback);
          }
-         free(call);
          /* don't check for new calls now to prevent the loop from blocking
          for i/o events. start an idle handle to call this function again */
          if (!callback->idle_active) {
             uv_idle_start(&callback->idle, uv_callback_idle_cb);
             callback->idle_active = 1;
          }
+      } else if (callback->has_shaped) {
+         /* no more calls that can be dispatched now. send the staged results */
+         flush_results(callback);
+         shaping_wait(callback);
       } else {
-         /* no more calls in the queue. stop the idle handle */
+         /* no more calls in the queue. send the staged results and stop the idle handle */
+         flush_results(callback);
          uv_idle_stop(&callback->idle);
          callback->idle_active = 0;
       }
@@ -221,6 +882,16 @@ void uv_callback_stop(uv_callback_t* callback) {
 
    if (callback->usequeue) {
       dequeue_all_from_callback(callback->master, callback);
+      /* discard the calls deferred by the shaping */
+      while (callback->deferred) {
+         uv_call_t *call = callback->deferred;
+         callback->deferred = call->next;
+         if (call->pipeline) pipeline_count(call, -1);
+         discard_call(call);
+      }
+      callback->deferred_tail = NULL;
+      /* send the results staged on this loop */
+      if (!callback->master) flush_results(callback);
    }
 
 }
@@ -240,12 +911,166 @@ void uv_callback_stop_all(uv_loop_t* loop) {
    uv_walk(loop, stop_all_on_walk, NULL);
 }
 
+/* Polling Mode **************************************************************/
+
+// on polling mode the loop thread drains the queue using uv_callback_poll,
+// usually from a UV_RUN_NOWAIT spin or a prepare/check handle, and the
+// producers don't signal the async handle. it avoids the eventfd write and
+// the loop wake up on each call, at the cost of burning CPU.
+
+// the queue is taken at once and the calls that exceed the budget are kept
+// on a local list of the master, the oldest first, for the next poll.
+// the calls deferred by the dispatch shaping are also drained, ignoring the
+// shaping limits.
+
+static uv_call_t * pop_polled_call(uv_callback_t* master) {
+   uv_call_t *call = master->polled;
+   if (call) {
+      master->polled = call->next;
+      if (call->pipeline) {
+         uv_mutex_lock(&master->mutex);
+         call->pipeline->depth[call->stage]--;
+         uv_mutex_unlock(&master->mutex);
+      }
+      TRACE_CALL(dequeue, TRACE_DEQUEUE, call);
+   }
+   return call;
+}
+
+static uv_call_t * next_polled_call(uv_callback_t* master) {
+   uv_call_t *call, *prev = NULL;
+
+   /* the deferred calls are older than the queued ones */
+   if (master->has_shaped) {
+      uv_callback_t *callback;
+      for (callback = master; callback; callback = callback->next) {
+         if (callback->deferred) {
+            call = callback->deferred;
+            callback->deferred = call->next;
+            if (!callback->deferred) callback->deferred_tail = NULL;
+            if (call->pipeline) pipeline_count(call, -1);
+            return call;
+         }
+      }
+   }
+
+   if (!master->polled) {
+      /* take all the queued calls */
+      uv_mutex_lock(&master->mutex);
+      call = master->queue;
+      master->queue = NULL;
+      uv_mutex_unlock(&master->mutex);
+      /* reverse the list */
+      while (call) {
+         uv_call_t *next = call->next;
+         call->next = prev;
+         prev = call;
+         call = next;
+      }
+      master->polled = prev;
+   }
+
+   return pop_polled_call(master);
+}
+
+int uv_callback_poll_start(uv_callback_t* callback) {
+   uv_callback_t *master;
+   if (!callback || !callback->usequeue) return UV_EINVAL;
+   master = callback->master ? callback->master : callback;
+   uv_mutex_lock(&master->mutex);
+   master->polling = 1;
+   uv_mutex_unlock(&master->mutex);
+   return 0;
+}
+
+int uv_callback_poll_stop(uv_callback_t* callback) {
+   uv_callback_t *master;
+   uv_call_t *call, *prev = NULL;
+
+   if (!callback || !callback->usequeue) return UV_EINVAL;
+   master = callback->master ? callback->master : callback;
+
+   /* the calls not processed go back to the end of the queue, the newest first */
+   call = master->polled;
+   master->polled = NULL;
+   while (call) {
+      uv_call_t *next = call->next;
+      call->next = prev;
+      prev = call;
+      call = next;
+   }
+
+   uv_mutex_lock(&master->mutex);
+   master->polling = 0;
+   if (prev) {
+      uv_call_t **link = &master->queue;
+      while (*link) link = &(*link)->next;
+      *link = prev;
+   }
+   uv_mutex_unlock(&master->mutex);
+
+   /* process the calls that were queued without a signal */
+   return uv_async_send((uv_async_t*)master);
+}
+
+int uv_callback_poll(uv_callback_t* callback, int budget) {
+   uv_callback_t *master;
+   uv_call_t *call;
+   int count = 0;
+
+   if (!callback || !callback->usequeue) return UV_EINVAL;
+   master = callback->master ? callback->master : callback;
+
+   while ((budget <= 0 || count < budget) && (call = next_polled_call(master))) {
+      if (call->callback->batch_function) {
+         /* group the consecutive calls to the same batch callback */
+         uv_call_t *calls[UV_CALLBACK_BATCH_MAX];
+         int n = 1;
+         calls[0] = call;
+         while (n < UV_CALLBACK_BATCH_MAX && (budget <= 0 || count + n < budget) &&
+                master->polled && master->polled->callback == call->callback) {
+            calls[n++] = pop_polled_call(master);
+         }
+         batch_call(calls, n);
+         count += n;
+         continue;
+      }
+      uv_callback_call(call);
+      count++;
+   }
+
+   flush_results(master);
+
+   return count;
+}
+
 /*****************************************************************************/
 /* SENDER / CALLER THREAD ****************************************************/
 /*****************************************************************************/
 
 /* Asynchronous Callback Firing **********************************************/
 
+int queue_call(uv_call_t *call) {
+   uv_callback_t *master = call->callback->master ? call->callback->master : call->callback;
+   int polling;
+
+   TRACE_CALL(enqueue, TRACE_ENQUEUE, call);
+
+   /* add the call to the queue */
+   uv_mutex_lock(&master->mutex);
+   call->next = master->queue;
+   master->queue = call;
+   if (call->pipeline) call->pipeline->depth[call->stage]++;
+   polling = master->polling;
+   uv_mutex_unlock(&master->mutex);
+
+   /* the consumer is polling the queue. no need to signal it */
+   if (polling) return 0;
+
+   /* call uv_async_send */
+   return uv_async_send((uv_async_t*)master);
+}
+
 int uv_callback_fire_ex(uv_callback_t* callback, void *data, int size, void (*free_data)(void*), uv_callback_t* notify) {
 
    if (!callback) return UV_EINVAL;
@@ -264,15 +1089,14 @@ int uv_callback_fire_ex(uv_callback_t* callback, void *data, int size, void (*fr
       call->notify = notify;
       call->callback = callback;
       call->free_data = free_data;
-      /* if there is a master callback, use it */
-      if (callback->master) callback = callback->master;
-      /* add the call to the queue */
-      uv_mutex_lock(&callback->mutex);
-      call->next = callback->queue;
-      callback->queue = call;
-      uv_mutex_unlock(&callback->mutex);
+      call->pipeline = NULL;
+      call->stage = 0;
+      call->trace_id = 0;
+      call->is_result = 0;
+      call->free_result = NULL;
       /* increase the reference counter */
       if (notify) notify->refcount++;
+      return queue_call(call);
    } else {
       callback->arg = data;
    }
@@ -285,6 +1109,85 @@ int uv_callback_fire(uv_callback_t* callback, void *data, uv_callback_t* notify)
    return uv_callback_fire_ex(callback, data, 0, NULL, notify);
 }
 
+/* Pipelines *****************************************************************/
+
+// a pipeline moves the same call record through its stages: the result of
+// each stage is the argument of the next one and the result of the last
+// stage is delivered to the notify callback. each stage owns its argument,
+// like a notify callback owns the result. if a stage is stopped the pending
+// arguments are released with the free_result of the previous stage.
+
+int uv_callback_pipeline_init(uv_callback_pipeline_t* pipeline, uv_callback_t** stages, int count) {
+   int i;
+
+   if (!pipeline || !stages || count <= 0) return UV_EINVAL;
+
+   for (i = 0; i < count; i++) {
+      if (!stages[i] || !stages[i]->usequeue) return UV_EINVAL;
+   }
+
+   memset(pipeline, 0, sizeof(uv_callback_pipeline_t));
+
+   pipeline->stages = malloc(count * sizeof(uv_callback_t*));
+   pipeline->depth = calloc(count, sizeof(int));
+   if (!pipeline->stages || !pipeline->depth) {
+      uv_callback_pipeline_release(pipeline);
+      return UV_ENOMEM;
+   }
+
+   memcpy(pipeline->stages, stages, count * sizeof(uv_callback_t*));
+   pipeline->count = count;
+   return 0;
+}
+
+void uv_callback_pipeline_release(uv_callback_pipeline_t* pipeline) {
+   if (!pipeline) return;
+   free(pipeline->stages);
+   free(pipeline->depth);
+   pipeline->stages = NULL;
+   pipeline->depth = NULL;
+   pipeline->count = 0;
+}
+
+int uv_callback_pipeline_fire(uv_callback_pipeline_t* pipeline, void *data, int size, void (*free_data)(void*), uv_callback_t* notify) {
+   uv_call_t *call;
+
+   if (!pipeline || pipeline->count == 0) return UV_EINVAL;
+   if (pipeline->stages[0]->inactive) return UV_EPERM;
+   if (notify && !notify->usequeue) return UV_EINVAL;
+
+   /* this call record is used until the end of the pipeline */
+   call = malloc(sizeof(uv_call_t));
+   if (!call) return UV_ENOMEM;
+   call->data = data;
+   call->size = size;
+   call->notify = notify;
+   call->callback = pipeline->stages[0];
+   call->free_data = free_data;
+   call->pipeline = pipeline;
+   call->stage = 0;
+   call->trace_id = 0;
+   call->is_result = 0;
+   call->free_result = NULL;
+
+   if (notify) notify->refcount++;
+   return queue_call(call);
+}
+
+int uv_callback_pipeline_depth(uv_callback_pipeline_t* pipeline, int stage) {
+   uv_callback_t *master;
+   int depth;
+
+   if (!pipeline || stage < 0 || stage >= pipeline->count) return UV_EINVAL;
+
+   master = pipeline->stages[stage]->master ? pipeline->stages[stage]->master : pipeline->stages[stage];
+   uv_mutex_lock(&master->mutex);
+   depth = pipeline->depth[stage];
+   uv_mutex_unlock(&master->mutex);
+
+   return depth;
+}
+
 /* Synchronous Callback Firing ***********************************************/
 
 struct call_result {
@@ -370,3 +1273,542 @@ loc_exit:
    return rc;
 
 }
+
+/*****************************************************************************/
+/* CROSS-PROCESS CALLS *******************************************************/
+/*****************************************************************************/
+
+#if defined(__linux__)
+
+// an exported callback is reachable from other processes through a shared
+// memory region (memfd) containing 2 rings: one for the calls and one for the
+// results. each ring has an eventfd used to wake up its consumer, but it is
+// only written when the consumer announced that it is sleeping. under load
+// the producers just copy the payload into a free slot, without syscalls.
+// the region can be imported by a single process, the one receiving the
+// results. the content of the shared memory is not trusted: the sizes are
+// checked and the notify callbacks are identified by an index on a local
+// table, never by a pointer.
+
+#define UV_CALLBACK_SHM_MAGIC    0x75766362   /* "uvcb" */
+#define UV_CALLBACK_SHM_ALIGN    64           /* cache line size */
+#define UV_CALLBACK_SHM_MAX_SLOTS   (1 << 20)
+#define UV_CALLBACK_SHM_MAX_STRIDE  (1 << 24)
+
+#define SHM_RING_CALLS    0
+#define SHM_RING_RESULTS  1
+
+#define SHM_SLOT_DISCARDED  1   /* the call was not executed or the result does not fit */
+
+struct shm_ring {
+   uint64_t tail;             /* next position to be written (producers) */
+   char pad1[UV_CALLBACK_SHM_ALIGN - sizeof(uint64_t)];
+   uint64_t head;             /* next position to be read (consumer) */
+   uint32_t sleeping;         /* the consumer is waiting for the eventfd */
+   char pad2[UV_CALLBACK_SHM_ALIGN - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+struct uv_callback_shm_header_s {
+   uint32_t magic;
+   uint32_t slots;            /* number of slots on each ring. power of 2 */
+   uint32_t stride;           /* size of each slot */
+   uint32_t importer;         /* set by the process that imported this region */
+   char pad[UV_CALLBACK_SHM_ALIGN - 4 * sizeof(uint32_t)];
+   struct shm_ring ring[2];
+};
+
+struct shm_pending_s {
+   struct shm_pending_s *next;
+   uint64_t token;
+   uint64_t value;
+   int32_t  size;
+   int32_t  flags;
+   char     data[];
+};
+
+struct shm_slot {
+   uint64_t seq;              /* sequence number used to synchronize producers and consumer */
+   uint64_t token;            /* notify callback on the calling process */
+   uint64_t value;            /* scalar argument when size is 0 */
+   int32_t  size;             /* size of the inline payload */
+   int32_t  flags;
+   char     data[];           /* inline payload */
+};
+
+/* Ring **********************************************************************/
+
+static int shm_max_size(uv_callback_shm_t* shm) {
+   return (int)(shm->stride - sizeof(struct shm_slot));
+}
+
+static struct shm_slot * shm_get_slot(uv_callback_shm_t* shm, int ring, uint64_t pos) {
+   char *base = (char*)shm->mem + sizeof(struct uv_callback_shm_header_s);
+   base += (size_t)ring * shm->slots * shm->stride;
+   return (struct shm_slot *)(base + (pos & (shm->slots - 1)) * shm->stride);
+}
+
+static int shm_ring_push(uv_callback_shm_t* shm, int index, uint64_t token, void *data, int size, int flags) {
+   struct shm_ring *ring = &shm->mem->ring[index];
+   struct shm_slot *slot;
+   uint64_t pos, one = 1;
+   int retries;
+
+   /* reserve a slot. multiple threads can be producing on this ring.
+   the tail and the sequences can be written by the peer, so the number of
+   retries is limited and inconsistent values are reported as an error */
+   pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+   for (retries = 0; ; retries++) {
+      int64_t dif;
+      if (retries > shm->slots) return UV_EAGAIN;
+      slot = shm_get_slot(shm, index, pos);
+      dif = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+      if (dif == 0) {
+         if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      } else if (dif < 0) {
+         return UV_ENOBUFS;  /* the ring is full */
+      } else if (dif > (int64_t)shm->slots) {
+         return UV_EPROTO;   /* the sequence is ahead of any valid position */
+      } else {
+         uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+         /* the slot was taken by another producer, so the tail must have moved */
+         if (tail == pos) return UV_EPROTO;
+         pos = tail;
+      }
+   }
+
+   /* copy the payload */
+   slot->token = token;
+   slot->flags = flags;
+   slot->size = size;
+   if (size > 0) {
+      memcpy(slot->data, data, size);
+      slot->value = 0;
+   } else {
+      slot->value = (uint64_t)(uintptr_t)data;
+   }
+
+   /* publish it */
+   __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+   /* wake up the consumer only if it is waiting. the slot is already
+   published, so a failure here cannot be reported as a failed push */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_ACQ_REL)) {
+      int fd = shm->fds[index == SHM_RING_CALLS ? 1 : 2];
+      if (write(fd, &one, sizeof(one)) < 0) {}
+   }
+
+   return 0;
+}
+
+static struct shm_slot * shm_ring_peek(uv_callback_shm_t* shm, int index) {
+   struct shm_ring *ring = &shm->mem->ring[index];
+   uint64_t pos = ring->head;
+   struct shm_slot *slot = shm_get_slot(shm, index, pos);
+   if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) return NULL;
+   return slot;
+}
+
+static void shm_ring_release(uv_callback_shm_t* shm, int index, struct shm_slot *slot) {
+   struct shm_ring *ring = &shm->mem->ring[index];
+   __atomic_store_n(&slot->seq, ring->head + shm->slots, __ATOMIC_RELEASE);
+   ring->head++;
+}
+
+/* Consumers *****************************************************************/
+
+/* results that did not fit on the ring are kept here until there is space */
+static int shm_defer_result(uv_callback_shm_t* shm, uint64_t token, void *data, int size, int flags) {
+   struct shm_pending_s *pending = malloc(sizeof(struct shm_pending_s) + size);
+   if (!pending) return UV_ENOMEM;
+   pending->next = NULL;
+   pending->token = token;
+   pending->flags = flags;
+   pending->size = size;
+   pending->value = size > 0 ? 0 : (uint64_t)(uintptr_t)data;
+   if (size > 0) memcpy(pending->data, data, size);
+   if (shm->pending_tail)
+      shm->pending_tail->next = pending;
+   else
+      shm->pending = pending;
+   shm->pending_tail = pending;
+   return 0;
+}
+
+/* returns 0 if all the pending results were sent */
+static int shm_send_pending(uv_callback_shm_t* shm) {
+   while (shm->pending) {
+      struct shm_pending_s *pending = shm->pending;
+      void *data = pending->size > 0 ? pending->data : (void*)(uintptr_t)pending->value;
+      if (shm_ring_push(shm, SHM_RING_RESULTS, pending->token, data, pending->size, pending->flags)) {
+         return UV_ENOBUFS;
+      }
+      shm->pending = pending->next;
+      if (!shm->pending) shm->pending_tail = NULL;
+      free(pending);
+   }
+   return 0;
+}
+
+static void shm_send_result(uv_callback_shm_t* shm, uint64_t token, void *data, int size, int flags) {
+   /* keep the order of the results */
+   if (shm->pending || shm_ring_push(shm, SHM_RING_RESULTS, token, data, size, flags)) {
+      if (shm_defer_result(shm, token, data, size, flags)) {
+         /* no memory: at least inform that the call was discarded */
+         shm_defer_result(shm, token, NULL, 0, SHM_SLOT_DISCARDED);
+      }
+   }
+}
+
+static void shm_on_call(uv_callback_shm_t* shm, struct shm_slot *slot) {
+   uv_callback_t *callback = shm->callback;
+   void *data, *result = NULL;
+   int size = slot->size, result_size = 0, flags = 0;
+   uint64_t token = slot->token;
+
+   /* the slot content comes from another process */
+   if (size < 0 || size > shm_max_size(shm)) {
+      flags = SHM_SLOT_DISCARDED;
+   } else if (!callback->inactive) {
+      /* the payload is used directly from the shared memory */
+      data = size > 0 ? slot->data : (void*)(uintptr_t)slot->value;
+      callback->result_size = 0;
+      result = callback->function(callback, data, size);
+      result_size = callback->result_size;
+   } else {
+      flags = SHM_SLOT_DISCARDED;
+   }
+
+   /* the payload is not valid after this point */
+   shm_ring_release(shm, SHM_RING_CALLS, slot);
+
+   if (token) {
+      if (result_size < 0 || result_size > shm_max_size(shm)) {
+         flags = SHM_SLOT_DISCARDED;
+      }
+      shm_send_result(shm, token, flags ? NULL : result, flags ? 0 : result_size, flags);
+      if (result && result_size > 0 && callback->free_result) {
+         callback->free_result(result);  /* it was copied */
+      }
+   } else if (result && callback->free_result) {
+      callback->free_result(result);
+   }
+}
+
+static uv_callback_t * shm_take_notify(uv_callback_shm_t* shm, uint64_t token) {
+   uv_callback_t *notify = NULL;
+   if (token == 0 || token > (uint64_t)shm->slots) return NULL;
+   uv_mutex_lock(&shm->mutex);
+   notify = shm->notify[token - 1];
+   if (notify) {
+      shm->notify[token - 1] = NULL;
+      shm->free_tokens[shm->free_count++] = (int)(token - 1);
+   }
+   uv_mutex_unlock(&shm->mutex);
+   return notify;
+}
+
+static void shm_on_result(uv_callback_shm_t* shm, struct shm_slot *slot) {
+   uint64_t token = slot->token;
+   int size = slot->size, flags = slot->flags;
+   void *result = NULL;
+   uv_callback_t *notify;
+
+   /* the slot content comes from another process */
+   if (size < 0 || size > shm_max_size(shm)) {
+      flags = SHM_SLOT_DISCARDED;
+      size = 0;
+   }
+
+   /* copy the result before releasing the slot */
+   if (!(flags & SHM_SLOT_DISCARDED)) {
+      if (size > 0) {
+         result = malloc(size);
+         if (result)
+            memcpy(result, slot->data, size);
+         else
+            flags = SHM_SLOT_DISCARDED;
+      } else {
+         result = (void*)(uintptr_t)slot->value;
+      }
+   }
+
+   shm_ring_release(shm, SHM_RING_RESULTS, slot);
+
+   /* only now the token can be reused by another call */
+   notify = shm_take_notify(shm, token);
+   if (!notify) {
+      if (size > 0) free(result);
+      return;
+   }
+
+   /* check if the result notification callback is still active */
+   if (!(flags & SHM_SLOT_DISCARDED) && !notify->inactive) {
+      if (uv_callback_fire_ex(notify, result, size, NULL, NULL) && size > 0) free(result);
+   } else if (size > 0) {
+      free(result);
+   }
+
+   uv_callback_release(notify);
+}
+
+static void shm_on_poll(uv_poll_t* handle, int status, int events) {
+   uv_callback_shm_t* shm = (uv_callback_shm_t*) handle;
+   int index = shm->callback ? SHM_RING_CALLS : SHM_RING_RESULTS;
+   struct shm_ring *ring = &shm->mem->ring[index];
+   struct shm_slot *slot;
+   uint64_t value;
+   int fd = shm->fds[index == SHM_RING_CALLS ? 1 : 2];
+   int count = 0;
+
+   /* reset the eventfd counter */
+   if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) return;
+
+   /* don't accept new calls while there are results waiting for space.
+   come back on the next loop iteration */
+   if (index == SHM_RING_CALLS && shm_send_pending(shm)) {
+      value = 1;
+      if (write(fd, &value, sizeof(value)) < 0) {}
+      return;
+   }
+
+   for (;;) {
+      slot = shm_ring_peek(shm, index);
+      if (!slot) {
+         /* announce that we are going to sleep and check again to not lose a wake up */
+         __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+         slot = shm_ring_peek(shm, index);
+         if (!slot) break;
+         __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+      }
+      /* don't drain more than a ring of calls now to prevent the loop from
+      blocking for i/o events. signal the eventfd to come back later */
+      if (count++ == shm->slots) {
+         value = 1;
+         if (write(fd, &value, sizeof(value)) < 0) {}
+         break;
+      }
+      if (index == SHM_RING_CALLS)
+         shm_on_call(shm, slot);
+      else
+         shm_on_result(shm, slot);
+   }
+
+}
+
+/* Export / Import ***********************************************************/
+
+static void shm_cleanup(uv_callback_shm_t* shm) {
+   int i;
+   while (shm->pending) {
+      struct shm_pending_s *pending = shm->pending;
+      shm->pending = pending->next;
+      free(pending);
+   }
+   shm->pending_tail = NULL;
+   if (shm->notify) {
+      /* the results of these calls will not arrive */
+      for (i = 0; i < shm->slots; i++) {
+         if (shm->notify[i]) uv_callback_release(shm->notify[i]);
+      }
+      free(shm->notify);
+      free(shm->free_tokens);
+      shm->notify = NULL;
+      shm->free_tokens = NULL;
+      uv_mutex_destroy(&shm->mutex);
+   }
+   if (shm->mem) {
+      munmap(shm->mem, shm->mem_size);
+      shm->mem = NULL;
+   }
+   for (i = 0; i < 3; i++) {
+      if (shm->fds[i] >= 0) close(shm->fds[i]);
+      shm->fds[i] = -1;
+   }
+}
+
+static int shm_start(uv_loop_t* loop, uv_callback_shm_t* shm, int fd) {
+   int rc = uv_poll_init(loop, &shm->poll, fd);
+   if (rc) return rc;
+   return uv_poll_start(&shm->poll, UV_READABLE, shm_on_poll);
+}
+
+int uv_callback_export(uv_callback_t* callback, uv_callback_shm_t* shm, int slots, int max_size) {
+   uv_callback_t *master;
+   uint64_t i;
+   int rc;
+
+   if (!callback || !shm || max_size < 0) return UV_EINVAL;
+   if (slots <= 0 || (slots & (slots - 1))) return UV_EINVAL;  /* must be a power of 2 */
+   if (slots > UV_CALLBACK_SHM_MAX_SLOTS) return UV_EINVAL;
+   if (max_size > UV_CALLBACK_SHM_MAX_STRIDE - (int)sizeof(struct shm_slot) - UV_CALLBACK_SHM_ALIGN) return UV_EINVAL;
+
+   memset(shm, 0, sizeof(uv_callback_shm_t));
+   shm->fds[0] = shm->fds[1] = shm->fds[2] = -1;
+   shm->slots = slots;
+   shm->stride = (sizeof(struct shm_slot) + max_size + UV_CALLBACK_SHM_ALIGN - 1) & ~(UV_CALLBACK_SHM_ALIGN - 1);
+   shm->mem_size = sizeof(struct uv_callback_shm_header_s) + (size_t)2 * slots * shm->stride;
+
+   /* create the shared memory and the eventfds */
+   shm->fds[0] = syscall(SYS_memfd_create, "uv_callback", 0);
+   if (shm->fds[0] < 0) goto loc_error;
+   if (ftruncate(shm->fds[0], shm->mem_size) < 0) goto loc_error;
+   shm->mem = mmap(NULL, shm->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fds[0], 0);
+   if (shm->mem == MAP_FAILED) { shm->mem = NULL; goto loc_error; }
+   shm->fds[1] = eventfd(0, EFD_NONBLOCK);
+   if (shm->fds[1] < 0) goto loc_error;
+   shm->fds[2] = eventfd(0, EFD_NONBLOCK);
+   if (shm->fds[2] < 0) goto loc_error;
+
+   /* initialize the rings. the memfd is zero filled */
+   shm->mem->magic = UV_CALLBACK_SHM_MAGIC;
+   shm->mem->slots = slots;
+   shm->mem->stride = shm->stride;
+   shm->mem->ring[SHM_RING_CALLS].sleeping = 1;
+   shm->mem->ring[SHM_RING_RESULTS].sleeping = 1;
+   for (i = 0; i < (uint64_t)slots; i++) {
+      shm_get_slot(shm, SHM_RING_CALLS, i)->seq = i;
+      shm_get_slot(shm, SHM_RING_RESULTS, i)->seq = i;
+   }
+
+   /* wait for calls on the loop of the exported callback */
+   master = callback->master ? callback->master : callback;
+   rc = shm_start(((uv_handle_t*)master)->loop, shm, shm->fds[1]);
+   if (rc) {
+      shm_cleanup(shm);
+      return rc;
+   }
+
+   shm->callback = callback;
+   callback->refcount++;
+   return 0;
+
+loc_error:
+   rc = uv_translate_sys_error(errno);
+   shm_cleanup(shm);
+   return rc;
+}
+
+void uv_callback_shm_fds(uv_callback_shm_t* shm, int fds[3]) {
+   fds[0] = shm->fds[0];
+   fds[1] = shm->fds[1];
+   fds[2] = shm->fds[2];
+}
+
+int uv_callback_import(uv_loop_t* loop, uv_callback_shm_t* shm, int fds[3]) {
+   struct uv_callback_shm_header_s *mem;
+   uint32_t slots, stride, expected = 0;
+   struct stat st;
+   int i, rc;
+
+   if (!loop || !shm || !fds) return UV_EINVAL;
+
+   memset(shm, 0, sizeof(uv_callback_shm_t));
+   shm->fds[0] = shm->fds[1] = shm->fds[2] = -1;
+
+   if (fstat(fds[0], &st) < 0) return uv_translate_sys_error(errno);
+   if ((size_t)st.st_size < sizeof(struct uv_callback_shm_header_s)) return UV_EINVAL;
+
+   mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+   if (mem == MAP_FAILED) return uv_translate_sys_error(errno);
+   slots = mem->slots;
+   stride = mem->stride;
+   if (mem->magic != UV_CALLBACK_SHM_MAGIC ||
+       slots == 0 || slots > UV_CALLBACK_SHM_MAX_SLOTS || (slots & (slots - 1)) ||
+       stride < sizeof(struct shm_slot) || stride > UV_CALLBACK_SHM_MAX_STRIDE ||
+       (size_t)st.st_size != sizeof(struct uv_callback_shm_header_s) + (size_t)2 * slots * stride) {
+      munmap(mem, st.st_size);
+      return UV_EINVAL;
+   }
+
+   /* the results ring can have a single consumer */
+   if (!__atomic_compare_exchange_n(&mem->importer, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      munmap(mem, st.st_size);
+      return UV_EBUSY;
+   }
+
+   shm->mem = mem;
+   shm->mem_size = st.st_size;
+   shm->slots = slots;
+   shm->stride = stride;
+   shm->fds[0] = fds[0];
+   shm->fds[1] = fds[1];
+   shm->fds[2] = fds[2];
+
+   /* table of notify callbacks waiting for a result */
+   shm->notify = calloc(slots, sizeof(uv_callback_t*));
+   shm->free_tokens = malloc(slots * sizeof(int));
+   if (!shm->notify || !shm->free_tokens || uv_mutex_init(&shm->mutex)) {
+      free(shm->notify);
+      free(shm->free_tokens);
+      shm->notify = NULL;
+      shm->free_tokens = NULL;
+      shm_cleanup(shm);
+      return UV_ENOMEM;
+   }
+   for (i = 0; i < (int)slots; i++) {
+      shm->free_tokens[i] = slots - 1 - i;
+   }
+   shm->free_count = slots;
+
+   /* wait for results on this loop */
+   rc = shm_start(loop, shm, shm->fds[2]);
+   if (rc) shm_cleanup(shm);
+   return rc;
+}
+
+int uv_callback_shm_fire(uv_callback_shm_t* shm, void *data, int size, uv_callback_t* notify) {
+   uint64_t token = 0;
+   int rc, index = 0;
+
+   if (!shm || !shm->mem || shm->callback) return UV_EINVAL;
+   if (size < 0) return UV_EINVAL;
+   if (size > shm_max_size(shm)) return UV_E2BIG;
+
+   /* the notification callback must use a queue */
+   if (notify) {
+      if (!notify->usequeue) return UV_EINVAL;
+      if (notify->inactive) return UV_EPERM;
+      /* reserve a token. it also limits the number of calls waiting
+      for a result to the size of the results ring */
+      uv_mutex_lock(&shm->mutex);
+      if (shm->free_count == 0) {
+         uv_mutex_unlock(&shm->mutex);
+         return UV_ENOBUFS;
+      }
+      index = shm->free_tokens[--shm->free_count];
+      shm->notify[index] = notify;
+      notify->refcount++;
+      uv_mutex_unlock(&shm->mutex);
+      token = index + 1;
+   }
+
+   rc = shm_ring_push(shm, SHM_RING_CALLS, token, data, size, 0);
+
+   if (rc && notify) {
+      uv_mutex_lock(&shm->mutex);
+      shm->notify[index] = NULL;
+      shm->free_tokens[shm->free_count++] = index;
+      notify->refcount--;
+      uv_mutex_unlock(&shm->mutex);
+   }
+
+   return rc;
+}
+
+// like uv_callback_stop, it must be called before closing the loop handles.
+// the poll handle is then closed together with the other handles.
+
+void uv_callback_shm_close(uv_callback_shm_t* shm) {
+   if (!shm || !shm->mem) return;
+   uv_poll_stop(&shm->poll);
+   shm_cleanup(shm);
+   if (shm->callback) {
+      uv_callback_release(shm->callback);
+      shm->callback = NULL;
+   }
+}
+
+#endif
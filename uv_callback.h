@@ -4,6 +4,7 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <uv.h>
 
 
@@ -11,11 +12,16 @@ extern "C" {
 
 typedef struct uv_callback_s   uv_callback_t;
 typedef struct uv_call_s       uv_call_t;
+typedef struct uv_callback_shm_s uv_callback_shm_t;
+typedef struct uv_callback_shaping_s uv_callback_shaping_t;
+typedef struct uv_callback_result_s uv_callback_result_t;
+typedef struct uv_callback_pipeline_s uv_callback_pipeline_t;
 
 
 /* Callback Functions */
 
 typedef void* (*uv_callback_func)(uv_callback_t* handle, void *data, int size);
+typedef void (*uv_callback_batch_func)(uv_callback_t* handle, uv_callback_result_t* results, int count);
 
 
 /* Functions */
@@ -31,10 +37,18 @@ int uv_callback_init_ex(
    void (*free_result)(void*)
 );
 
+int uv_callback_set_shaping(uv_callback_t* callback, const uv_callback_shaping_t* shaping);
+int uv_callback_set_batch(uv_callback_t* callback, uv_callback_batch_func function);
+
 int uv_callback_fire(uv_callback_t* callback, void *data, uv_callback_t* notify);
 
 int uv_callback_fire_ex(uv_callback_t* callback, void *data, int size, void (*free_data)(void*), uv_callback_t* notify);
 
+int uv_callback_pipeline_init(uv_callback_pipeline_t* pipeline, uv_callback_t** stages, int count);
+int uv_callback_pipeline_fire(uv_callback_pipeline_t* pipeline, void *data, int size, void (*free_data)(void*), uv_callback_t* notify);
+int uv_callback_pipeline_depth(uv_callback_pipeline_t* pipeline, int stage);
+void uv_callback_pipeline_release(uv_callback_pipeline_t* pipeline);
+
 int uv_callback_fire_sync(uv_callback_t* callback, void *data, void** presult, int timeout);
 
 void uv_callback_stop(uv_callback_t* callback);
@@ -43,15 +57,55 @@ void uv_callback_stop_all(uv_loop_t* loop);
 int uv_is_callback(uv_handle_t *handle);
 void uv_callback_release(uv_callback_t *callback);
 
+int uv_callback_poll_start(uv_callback_t* callback);
+int uv_callback_poll_stop(uv_callback_t* callback);
+int uv_callback_poll(uv_callback_t* callback, int budget);
+
+
+/* Tracing */
+
+void uv_callback_trace_enable(int enable);
+int uv_callback_trace_dump(FILE *file);
+
+
+/* Cross-Process Calls (Linux only) */
+
+#if defined(__linux__)
+
+int uv_callback_export(uv_callback_t* callback, uv_callback_shm_t* shm, int slots, int max_size);
+void uv_callback_shm_fds(uv_callback_shm_t* shm, int fds[3]);
+
+int uv_callback_import(uv_loop_t* loop, uv_callback_shm_t* shm, int fds[3]);
+int uv_callback_shm_fire(uv_callback_shm_t* shm, void *data, int size, uv_callback_t* notify);
+
+void uv_callback_shm_close(uv_callback_shm_t* shm);
+
+#endif
+
 
 /* Constants */
 
 #define UV_DEFAULT      0
 #define UV_COALESCE     1
 
+#ifndef UV_CALLBACK_BATCH_MAX
+#define UV_CALLBACK_BATCH_MAX  64   /* max results delivered at once to a batch callback */
+#endif
+
 
 /* Structures */
 
+struct uv_callback_result_s {
+   void *data;                /* result of the call */
+   int size;                  /* size of the result */
+};
+
+struct uv_callback_shaping_s {
+   double rate;               /* calls per second. 0 for no limit */
+   int burst;                 /* calls that can be dispatched in sequence when the rate limit is not reached */
+   uint64_t max_time;         /* handler CPU time per millisecond of loop time, in microseconds. 0 for no limit */
+};
+
 struct uv_callback_s {
    uv_async_t async;          /* base async handle used for thread signal */
    void *data;                /* additional data pointer. not the same from the handle */
@@ -62,12 +116,29 @@ struct uv_callback_s {
    void *arg;                 /* data argument for coalescing calls (when not using queue) */
    uv_idle_t idle;            /* idle handle used to drain the queue if new async request was sent while an old one was being processed */
    int idle_active;           /* flags if the idle handle is active */
+   int polling;               /* the queue is drained by uv_callback_poll. the producers don't signal the async handle */
+   uv_call_t *polled;         /* calls taken from the queue by uv_callback_poll and not yet processed, the oldest first */
    uv_callback_t *master;     /* master callback handle, the one with the valid uv_async handle */
    uv_callback_t *next;       /* the next callback from this uv_async handle */
    int inactive;              /* this callback is no more valid. the called thread should not fire the response callback */
    int refcount;              /* reference counter */
    void (*free_cb)(void*);    /* function to release this object */
    void (*free_result)(void*);/* function to release the result of the call if not used */
+   int result_size;           /* size of the returned result, set by the function when it must be copied */
+   int shaped;                /* uses dispatch shaping */
+   int has_shaped;            /* on the master: at least one of its callbacks uses dispatch shaping */
+   uv_callback_shaping_t shaping; /* dispatch shaping parameters */
+   double tokens;             /* tokens available on the rate limiter */
+   uint64_t last_refill;      /* last time the tokens were refilled */
+   uint64_t time_debt;        /* handler CPU time exceeding the budget, paid on the next loop iterations */
+   uint64_t paid_at;          /* on the master: loop time of the last debt payment */
+   uv_call_t *deferred;       /* calls deferred by the shaping, the oldest first */
+   uv_call_t *deferred_tail;  /* last deferred call */
+   uv_timer_t timer;          /* timer used to wait for the rate limiter or the time debt */
+   int timer_init;            /* flags if the timer handle was initialized */
+   uv_call_t *results;        /* on the master: results waiting to be sent to the notify callbacks */
+   int staged;                /* on the master: number of staged results */
+   uv_callback_batch_func batch_function; /* receives the queued results at once */
 };
 
 struct uv_call_s {
@@ -77,8 +148,37 @@ struct uv_call_s {
    int   size;                /* size argument for this call */
    void (*free_data)(void*);  /* function to release the data if the call is not fired */
    uv_callback_t *notify;     /* callback to be fired with the result of this one */
+   uv_callback_pipeline_t *pipeline; /* pipeline this call is moving through */
+   int stage;                 /* current stage on the pipeline */
+   uint64_t trace_id;         /* trace id. 0 if tracing was disabled when the call was fired */
+   int is_result;             /* this call delivers the result of another call */
+   void (*free_result)(void*);/* function to release the result if it is not delivered */
+};
+
+struct uv_callback_pipeline_s {
+   uv_callback_t **stages;    /* the stages, in order */
+   int *depth;                /* number of calls waiting on each stage: staged, queued or deferred */
+   int count;                 /* number of stages */
 };
 
+#if defined(__linux__)
+struct uv_callback_shm_s {
+   uv_poll_t poll;            /* poll handle watching the eventfd of the incoming ring */
+   uv_callback_t *callback;   /* exported callback. NULL on the importing side */
+   struct uv_callback_shm_header_s *mem; /* mapped shared memory */
+   size_t mem_size;           /* size of the mapped memory */
+   int slots;                 /* number of slots on each ring */
+   int stride;                /* size of each slot, including its header */
+   int fds[3];                /* memfd, eventfd for calls, eventfd for results */
+   uv_mutex_t mutex;          /* protects the table of notify callbacks */
+   uv_callback_t **notify;    /* notify callbacks waiting for a result, indexed by token. importing side */
+   int *free_tokens;          /* stack of unused tokens. importing side */
+   int free_count;            /* number of unused tokens */
+   struct shm_pending_s *pending; /* results not sent because the ring was full. exporting side */
+   struct shm_pending_s *pending_tail;
+};
+#endif
+
 
 #ifdef __cplusplus
 }